@@ -93,8 +93,65 @@ int test_mode(string imagePath, string dbPath) {
     FR_ERROR("    Error removing test file: ");
   }
 
+  bool passed = true;
+  string enrollName = "enrolltest";
+  filesystem::path enrollPath = filesystem::path(dbPath) / enrollName;
+
+  FR_INFO("11. Enrolling the test image as '%s', also writing it to the database...",
+          enrollName.c_str());
+  uint64_t id = facerecognizer.enroll(enrollName, imread(imagePath), true);
+  if (id == 0 || !filesystem::exists(enrollPath)) {
+    FR_WARNING("    Enrollment failed");
+    passed = false;
+  }
+
+  FR_INFO("12. Running face recognition, expecting '%s'...", enrollName.c_str());
+  result = facerecognizer.run_one_face(imread(imagePath));
+  FR_INFO("    Found name: %s", result.toString().c_str());
+  if (result.name != enrollName) {
+    FR_WARNING("    Enrolled person was not recognized");
+    passed = false;
+  }
+
+  FR_INFO("13. Saving the features to a cache file...");
+  filesystem::path cachePath = filesystem::temp_directory_path() / "facerecognition_test.yml";
+  if (!facerecognizer.saveFeatures(cachePath)) {
+    FR_WARNING("    Cannot save the feature cache");
+    passed = false;
+  }
+
+  FR_INFO("14. Removing '%s' in memory only...", enrollName.c_str());
+  facerecognizer.remove(enrollName);
+  result = facerecognizer.run_one_face(imread(imagePath));
+  FR_INFO("    Found name: %s", result.toString().c_str());
+  if (result.name == enrollName || facerecognizer.getTemplateCount(enrollName) != 0) {
+    FR_WARNING("    Removed person is still recognized");
+    passed = false;
+  }
+
+  FR_INFO("15. Loading the feature cache, expecting '%s' again...", enrollName.c_str());
+  if (!facerecognizer.loadFeatures(cachePath) ||
+      facerecognizer.getTemplateCount(enrollName) != 1) {
+    FR_WARNING("    Feature cache round trip failed");
+    passed = false;
+  }
+  result = facerecognizer.run_one_face(imread(imagePath));
+  FR_INFO("    Found name: %s", result.toString().c_str());
+  if (result.name != enrollName) {
+    FR_WARNING("    Person from the feature cache was not recognized");
+    passed = false;
+  }
+  filesystem::remove(cachePath);
+
+  FR_INFO("16. Removing '%s' together with its database folder...", enrollName.c_str());
+  facerecognizer.remove(enrollName, true);
+  if (filesystem::exists(enrollPath) || facerecognizer.getTemplateCount(enrollName) != 0) {
+    FR_WARNING("    Removal failed");
+    passed = false;
+  }
+
   // Stop watching (this will be done automatically by destructor, but let's be explicit)
-  FR_INFO("11. Stopping database watcher...");
+  FR_INFO("17. Stopping database watcher...");
   facerecognizer.stopWatching();
 
   FR_INFO("=== Test completed ===");
@@ -103,6 +160,11 @@ int test_mode(string imagePath, string dbPath) {
   FR_INFO("- First face recognition run");
   FR_INFO("- Database change detection and automatic reload");
   FR_INFO("- Second face recognition run working normally");
+  FR_INFO("- Enrolled person recognized, removed and restored from the feature cache");
+  if (!passed) {
+    FR_WARNING("Some checks failed, see the warnings above");
+    return 1;
+  }
 
   return 0;
 }
@@ -121,9 +183,6 @@ int main(int argc, char **argv) {
   CLI11_PARSE(app, argc, argv);
 
   if (!isTestMode)
-    simple(imagePath, dbPath);
-  else
-    test_mode(imagePath, dbPath);
-
-  return 0;
+    return simple(imagePath, dbPath);
+  return test_mode(imagePath, dbPath);
 }
@@ -0,0 +1,323 @@
+#include "facerecognition.hpp"
+#include "helper.hpp"
+#include <CLI11.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <opencv2/imgcodecs.hpp>
+
+using namespace cv;
+using namespace std;
+
+/// @brief One labelled image of the evaluation folder
+struct Sample {
+  string person;
+  filesystem::path path;
+  /// @brief Feature of the largest face, empty if no face was found
+  Mat feature;
+};
+
+/// @brief Scores of one probe image against every identity of the gallery
+struct ProbeScores {
+  string person;
+  /// @brief Whether the identity of the probe is enrolled in the gallery
+  bool known;
+  /// @brief Best score per gallery identity
+  map<string, float> scores;
+
+  /// @brief Returns the best matching identity and its score
+  MatchResult best() const {
+    MatchResult bestmatch = {"Unknown", -1.0f};
+    for (const auto &pair : scores) {
+      if (pair.second > bestmatch.score)
+        bestmatch = MatchResult{pair.first, pair.second};
+    }
+    return bestmatch;
+  }
+};
+
+/// @brief Detector settings of one point of the configuration grid
+struct DetectorSetting {
+  int maxSize;
+  float scoreThreshold;
+  float nmsThreshold;
+  int topK;
+};
+
+/// @brief Lists the images per person, in the same layout as loadPersonsDB
+vector<Sample> listSamples(const filesystem::path &folder) {
+  vector<Sample> samples;
+  for (auto &p : filesystem::directory_iterator(folder)) {
+    if (!p.is_directory())
+      continue;
+    for (auto &imgPath : filesystem::directory_iterator(p.path())) {
+      if (imgPath.is_directory() ||
+          imgPath.path().filename().string().find("_visualize") != string::npos)
+        continue;
+      samples.push_back(Sample{p.path().filename().string(), imgPath.path(), Mat()});
+    }
+  }
+  // Sort for reproducible folds
+  sort(samples.begin(), samples.end(),
+       [](const Sample &a, const Sample &b) { return a.path < b.path; });
+  return samples;
+}
+
+/// @brief Extracts the feature of the largest face of every image. The time spent is
+/// accumulated in the stage timings of the recognizer.
+void extractAll(FaceRecognition &facerecognizer, vector<Sample> &samples) {
+  for (Sample &sample : samples) {
+    sample.feature = Mat();
+    Mat img = imread(sample.path.string());
+    if (img.empty()) {
+      FR_WARNING("Cannot read image: %s", sample.path.c_str());
+      continue;
+    }
+    vector<DetectedFace> faces = facerecognizer.detectFaces(img);
+    if (faces.empty())
+      continue;
+    auto largest = max_element(faces.begin(), faces.end(),
+                               [](const DetectedFace &a, const DetectedFace &b) {
+                                 return a.bbox().area() < b.bbox().area();
+                               });
+    sample.feature = largest->feature;
+  }
+}
+
+/// @brief Runs the k-fold gallery/probe splits on the extracted features
+/// @param matchMs Set to the total time spent in findBestMatch
+/// @param matches Set to the number of findBestMatch calls
+/// @param skipped Set to the number of probes of persons without gallery images in their fold
+vector<ProbeScores> runFolds(FaceRecognition &facerecognizer, const vector<Sample> &samples,
+                             int folds, bool openSet, double &matchMs, size_t &matches,
+                             size_t &skipped) {
+  // Index of every person and of every image within its person
+  map<string, int> personIndex;
+  vector<int> imageIndex;
+  map<string, int> imageCount;
+  for (const Sample &sample : samples) {
+    personIndex.emplace(sample.person, (int)personIndex.size());
+    imageIndex.push_back(imageCount[sample.person]++);
+  }
+
+  vector<ProbeScores> probes;
+  matchMs = 0.0;
+  matches = 0;
+  skipped = 0;
+  for (int fold = 0; fold < folds; fold++) {
+    for (const auto &pair : personIndex)
+      facerecognizer.remove(pair.first);
+
+    // In open-set mode every person is left out of the gallery in one fold
+    auto leftOut = [&](const string &person) {
+      return openSet && personIndex[person] % folds == fold;
+    };
+    vector<const Sample *> foldProbes;
+    map<string, int> galleryCount;
+    for (size_t i = 0; i < samples.size(); i++) {
+      const Sample &sample = samples[i];
+      if (sample.feature.empty())
+        continue;
+      if (leftOut(sample.person) || imageIndex[i] % folds == fold)
+        foldProbes.push_back(&sample);
+      else if (facerecognizer.enrollFeature(sample.person, sample.feature))
+        galleryCount[sample.person]++;
+    }
+
+    for (const Sample *sample : foldProbes) {
+      bool known = !leftOut(sample->person);
+      // Too few images to enroll and probe in this fold, neither known nor unknown
+      if (known && galleryCount[sample->person] == 0) {
+        skipped++;
+        continue;
+      }
+      auto start = chrono::steady_clock::now();
+      MatchResults results = facerecognizer.findBestMatch(sample->feature);
+      matchMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      matches++;
+      ProbeScores probe{sample->person, known, {}};
+      for (const MatchResult &result : results.results) {
+        auto it = probe.scores.find(result.name);
+        if (it == probe.scores.end() || result.score > it->second)
+          probe.scores[result.name] = result.score;
+      }
+      probes.push_back(probe);
+    }
+  }
+  return probes;
+}
+
+/// @brief Escapes a string for use in JSON
+string jsonString(const string &str) {
+  string escaped = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped + "\"";
+}
+
+/// @brief Computes the accuracy metrics of one detector setting as a JSON object
+string evaluate(const DetectorSetting &setting, const vector<Sample> &samples,
+                const vector<ProbeScores> &probes, const vector<float> &matchThresholds,
+                const vector<float> &fars, const StageTimings &timings, double matchMs,
+                size_t matches, size_t skipped) {
+  vector<float> genuine, impostor;
+  size_t known = 0, unknown = 0, rank1 = 0;
+  for (const ProbeScores &probe : probes) {
+    for (const auto &pair : probe.scores) {
+      if (pair.first == probe.person)
+        genuine.push_back(pair.second);
+      else
+        impostor.push_back(pair.second);
+    }
+    if (probe.known) {
+      known++;
+      if (probe.best().name == probe.person)
+        rank1++;
+    } else {
+      unknown++;
+    }
+  }
+  sort(impostor.begin(), impostor.end(), greater<float>());
+  size_t noFace = count_if(samples.begin(), samples.end(),
+                           [](const Sample &sample) { return sample.feature.empty(); });
+  auto ratio = [](size_t a, size_t b) { return b > 0 ? a / (double)b : 0.0; };
+
+  ostringstream oss;
+  oss << fixed << setprecision(4);
+  oss << "    {\n"
+      << "      \"maxSize\": " << setting.maxSize << ",\n"
+      << "      \"scoreThreshold\": " << setting.scoreThreshold << ",\n"
+      << "      \"nmsThreshold\": " << setting.nmsThreshold << ",\n"
+      << "      \"topK\": " << setting.topK << ",\n"
+      << "      \"noFaceRate\": " << ratio(noFace, samples.size()) << ",\n"
+      << "      \"imagesPerSecond\": "
+      << (timings.totalMs > 0 ? timings.frames / (timings.totalMs / 1000.0) : 0) << ",\n"
+      << "      \"latencyMs\": {\"detect\": "
+      << (timings.frames ? timings.detectMs / timings.frames : 0)
+      << ", \"featurePerFace\": " << (timings.faces ? timings.featureMs / timings.faces : 0)
+      << ", \"match\": " << (matches ? matchMs / matches : 0) << "},\n"
+      << "      \"knownProbes\": " << known << ",\n"
+      << "      \"unknownProbes\": " << unknown << ",\n"
+      << "      \"skippedProbes\": " << skipped << ",\n"
+      << "      \"rank1\": " << ratio(rank1, known) << ",\n";
+
+  // Verification: accept where the score exceeds the impostor score quantile of the FAR.
+  // With few impostor scores the requested FAR cannot be reached, so report the achieved one.
+  oss << "      \"tarAtFar\": [";
+  for (size_t i = 0; i < fars.size(); i++) {
+    float threshold = 1.0f;
+    if (!impostor.empty())
+      threshold = impostor[min(impostor.size() - 1, size_t(fars[i] * impostor.size()))];
+    auto above = [threshold](float score) { return score > threshold; };
+    size_t accepted = count_if(genuine.begin(), genuine.end(), above);
+    size_t falseAccepted = count_if(impostor.begin(), impostor.end(), above);
+    oss << (i ? ",\n        " : "\n        ") << "{\"far\": " << fars[i]
+        << ", \"achievedFar\": " << ratio(falseAccepted, impostor.size())
+        << ", \"threshold\": " << threshold << ", \"tar\": " << ratio(accepted, genuine.size())
+        << "}";
+  }
+  oss << "\n      ],\n";
+
+  // Identification: what run() would report with the given match threshold
+  oss << "      \"matchThresholds\": [";
+  for (size_t i = 0; i < matchThresholds.size(); i++) {
+    size_t identified = 0, rejected = 0;
+    for (const ProbeScores &probe : probes) {
+      MatchResult best = probe.best();
+      bool accepted = best.score > matchThresholds[i];
+      if (probe.known && accepted && best.name == probe.person)
+        identified++;
+      if (!probe.known && !accepted)
+        rejected++;
+    }
+    oss << (i ? ",\n        " : "\n        ") << "{\"threshold\": " << matchThresholds[i]
+        << ", \"identificationRate\": " << ratio(identified, known)
+        << ", \"unknownRejectionRate\": " << ratio(rejected, unknown) << "}";
+  }
+  oss << "\n      ]\n    }";
+  return oss.str();
+}
+
+int main(int argc, char **argv) {
+  disableCoreDumps();
+
+  CLI::App app("Face Recognition evaluation of accuracy and throughput");
+  string dbPath = "/app/media/db";
+  string outputPath = "./media/eval.json";
+  int folds = 5;
+  bool closedSet = false;
+  vector<int> maxSizes = {320, 400, 600};
+  vector<float> scoreThresholds = {0.7f};
+  vector<float> nmsThresholds = {0.3f};
+  vector<int> topKs = {5000};
+  vector<float> matchThresholds = {0.3f, 0.363f, 0.4f, 0.5f};
+  vector<float> fars = {0.001f, 0.01f, 0.1f};
+
+  app.add_option("-d,--db", dbPath, "Path to the labelled faces folder")
+      ->check(CLI::ExistingDirectory);
+  app.add_option("-o,--output", outputPath, "Path of the JSON report");
+  app.add_option("-k,--folds", folds, "Number of gallery/probe splits")->check(CLI::Range(2, 100));
+  app.add_flag("--closed-set", closedSet, "Keep every person in the gallery of every fold");
+  app.add_option("--max-sizes", maxSizes, "Maximum frame sizes to sweep")->delimiter(',');
+  app.add_option("--score-thresholds", scoreThresholds, "Detector score thresholds to sweep")
+      ->delimiter(',');
+  app.add_option("--nms-thresholds", nmsThresholds, "Detector NMS thresholds to sweep")
+      ->delimiter(',');
+  app.add_option("--top-k", topKs, "Detector top-k values to sweep")->delimiter(',');
+  app.add_option("--match-thresholds", matchThresholds, "Match thresholds to evaluate")
+      ->delimiter(',');
+  app.add_option("--far", fars, "False accept rates for TAR@FAR")->delimiter(',');
+  CLI11_PARSE(app, argc, argv);
+
+  vector<Sample> samples = listSamples(dbPath);
+  if (samples.empty()) {
+    FR_WARNING("No images found in %s", dbPath.c_str());
+    return 1;
+  }
+
+  FaceRecognition facerecognizer;
+  vector<string> results;
+  for (int maxSize : maxSizes) {
+    for (float scoreThreshold : scoreThresholds) {
+      for (float nmsThreshold : nmsThresholds) {
+        for (int topK : topKs) {
+          DetectorSetting setting{maxSize, scoreThreshold, nmsThreshold, topK};
+          FR_INFO("Evaluating maxSize %d, score %.2f, nms %.2f, topK %d", maxSize, scoreThreshold,
+                  nmsThreshold, topK);
+          facerecognizer.setMaxSize(maxSize);
+          facerecognizer.setDetectionParams(scoreThreshold, nmsThreshold, topK);
+          facerecognizer.resetStageTimings();
+          extractAll(facerecognizer, samples);
+          StageTimings timings = facerecognizer.getStageTimings();
+          double matchMs;
+          size_t matches, skipped;
+          vector<ProbeScores> probes =
+              runFolds(facerecognizer, samples, folds, !closedSet, matchMs, matches, skipped);
+          results.push_back(evaluate(setting, samples, probes, matchThresholds, fars, timings,
+                                     matchMs, matches, skipped));
+        }
+      }
+    }
+  }
+
+  ofstream out(outputPath);
+  if (!out) {
+    FR_WARNING("Cannot write report: %s", outputPath.c_str());
+    return 1;
+  }
+  out << "{\n"
+      << "  \"dataset\": " << jsonString(dbPath) << ",\n"
+      << "  \"images\": " << samples.size() << ",\n"
+      << "  \"folds\": " << folds << ",\n"
+      << "  \"openSet\": " << (closedSet ? "false" : "true") << ",\n"
+      << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++)
+    out << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+  out << "  ]\n}\n";
+  FR_INFO("Wrote report to %s", outputPath.c_str());
+  return 0;
+}
@@ -1,9 +1,15 @@
 #pragma once
 #include <atomic>
+#include <cstdint>
 #include <filesystem>
+#include <map>
+#include <mutex>
 #include <opencv2/opencv.hpp>
+#include <set>
+#include <shared_mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
 using namespace cv;
 using namespace std;
@@ -78,6 +84,118 @@ public:
   }
 };
 
+/**
+ * Structure to hold one enrolled feature of a person and the image it was
+ * extracted from. The source is empty for features enrolled directly.
+ */
+struct FaceTemplate {
+  Mat feature;
+  filesystem::path source;
+  /// @brief Handle of the template, stays the same across reloads
+  uint64_t id = 0;
+};
+
+/**
+ * Settings of the motion gate, which skips face detection on frames of a
+ * static camera that did not change against the running background.
+ */
+struct MotionGateConfig {
+  /// @brief Width of the downsampled grayscale frame compared to the background
+  int sampleWidth = 64;
+  /// @brief Minimal gray value difference for a sample pixel to count as changed
+  float pixelThreshold = 25.0f;
+  /// @brief Fraction of changed sample pixels needed to run the detection
+  float minChangedFraction = 0.005f;
+  /// @brief How fast the background adapts to the current frame (0..1)
+  float learningRate = 0.05f;
+  /// @brief Force a full detection after this many frames, 0 disables it
+  int keyframeInterval = 100;
+  /// @brief Only search the changed region of the frame for faces
+  bool changedRegionOnly = false;
+};
+
+/**
+ * Structure to hold the frame counters of the motion gate.
+ */
+struct FrameStats {
+  uint64_t frames = 0;
+  uint64_t processed = 0;
+  uint64_t skipped = 0;
+  uint64_t keyframes = 0;
+
+  string toString() const {
+    ostringstream oss;
+    oss << "frames: " << frames << ", processed: " << processed << ", skipped: " << skipped
+        << ", keyframes: " << keyframes;
+    return oss.str();
+  }
+};
+
+/**
+ * @class MotionGate
+ * @brief Motion gate state of one camera stream. Each stream needs its own
+ * gate, which is not meant to be shared between threads.
+ */
+class MotionGate {
+public:
+  MotionGate(const MotionGateConfig &config = MotionGateConfig()) : config(config) {}
+
+  /**
+   * Compares the frame against the running background.
+   *
+   * @param frame The input frame.
+   * @param region Set to the changed region in frame coordinates, if only that
+   * region needs to be searched for faces. Empty for the full frame.
+   * @return false if the frame can be skipped.
+   */
+  bool check(const Mat &frame, Rect &region);
+
+  /**
+   * Forgets the background, the next frame is processed in full.
+   */
+  void reset() {
+    background = Mat();
+    framesSinceKeyframe = 0;
+  }
+
+  /// @brief Whether the last frame was skipped
+  bool wasSkipped() const { return skipped; }
+  /// @brief Results of the last processed frame, returned for skipped frames
+  const vector<MatchResult> &getLastResults() const { return lastResults; }
+  const FrameStats &getStats() const { return stats; }
+  const MotionGateConfig &getConfig() const { return config; }
+
+private:
+  friend class FaceRecognition;
+
+  MotionGateConfig config;
+  /// @brief Running background of the downsampled grayscale frames
+  Mat background;
+  /// @brief Frames since the last detection on the full frame
+  int framesSinceKeyframe = 0;
+  /// @brief Whether the last frame was skipped
+  bool skipped = false;
+  vector<MatchResult> lastResults;
+  FrameStats stats;
+};
+
+/**
+ * Structure to hold the accumulated inference times of the detection and
+ * recognition stages.
+ */
+struct StageTimings {
+  /// @brief Total time spent in resizing, detection and feature extraction
+  double totalMs = 0.0;
+  /// @brief Total time spent in the face detector
+  double detectMs = 0.0;
+  /// @brief Total time spent in alignment and feature extraction
+  double featureMs = 0.0;
+  /// @brief Number of frames passed to the face detector
+  uint64_t frames = 0;
+  /// @brief Number of faces passed to the feature extraction
+  uint64_t faces = 0;
+};
+
 /**
  * @class FaceRecognition
  * @brief Handles face recognition, directory hashing, and feature storage.
@@ -93,13 +211,23 @@ public:
 
   void setMaxSize(int size) { maxSize = size; }
 
+  /**
+   * Sets the parameters of the face detector.
+   *
+   * @param score_threshold Minimal confidence of a detected face.
+   * @param nms_threshold Overlap threshold of the non-maximum suppression.
+   * @param top_k Number of candidates kept before the non-maximum suppression.
+   */
+  void setDetectionParams(float score_threshold, float nms_threshold, int top_k);
+
   /**
    * Destructor - stops watching thread if running.
    */
   ~FaceRecognition();
 
   /**
-   * Loads the persons database from the specified folder.
+   * Loads the persons database from the specified folder. Templates enrolled
+   * in memory only, with enrollFeature or without persisting, are kept.
    *
    * @param persondb_folder The folder containing the persons database.
    * @param force If true, forces reloading the database even if it's already
@@ -131,6 +259,21 @@ public:
    */
   vector<MatchResult> run(Mat &frame, float threshold = 0.3f, bool visualize = false);
 
+  /**
+   * Performs face recognition on a frame of a static camera. Frames without
+   * significant change against the gate's background are skipped. Then the
+   * results of the last processed frame are returned and the frame is not
+   * visualized, gate.wasSkipped() tells these frames apart.
+   *
+   * @param frame The input frame where faces will be detected and recognized.
+   * @param gate The motion gate of the camera stream.
+   * @param threshold The similarity threshold for matching.
+   * @param visualize If true, visualizes the detected faces.
+   * @return list of Matching faces with their names and scores.
+   */
+  vector<MatchResult> run(Mat &frame, MotionGate &gate, float threshold = 0.3f,
+                          bool visualize = false);
+
   /**
    * Performs face recognition on the given frame. Returns only the best
    * matching face.
@@ -142,6 +285,13 @@ public:
    */
   MatchResult run_one_face(Mat frame, float threshold = 0.3f, bool visualize = false);
 
+  /**
+   * Performs face recognition on a frame of a static camera, see run() with a
+   * MotionGate. Returns only the best matching face.
+   */
+  MatchResult run_one_face(Mat frame, MotionGate &gate, float threshold = 0.3f,
+                           bool visualize = false);
+
   /**
    * @brief Annotate the frame with the name of the person
    * @param frame Image to be altered
@@ -150,10 +300,120 @@ public:
    */
   void annotate_with_name(cv::Mat &frame, const DetectedFace &face);
 
+  /**
+   * Detects the faces in the given frame and extracts their features. The
+   * frame is not altered.
+   *
+   * @param frame The input frame containing faces.
+   * @return The detected faces with their features, empty if the frame is
+   * empty. The boxes refer to the frame resized to the maximum size.
+   */
+  vector<DetectedFace> detectFaces(const Mat &frame);
+
+  /**
+   * Finds the best matching person for the given face feature.
+   *
+   * @param faceFeature The feature vector of the face to match.
+   * @param threshold The similarity threshold for matching.
+   * @return A MatchResults object, containing a vector of MatchResult
+   * structures and the name of the best matching person.
+   */
+  MatchResults findBestMatch(const Mat &faceFeature, float threshold = 0.3f);
+
+  /**
+   * Enrolls the largest face found in the frame for the given person. The
+   * gallery is updated in memory, no reload of the database is needed.
+   *
+   * @param name The name of the person.
+   * @param frame The image containing the face of the person.
+   * @param persist If true, a crop around the enrolled face is also written
+   * into the person's sub-folder of the database, so it is still known after
+   * a restart.
+   * @return The id of the new template, 0 if no face was found.
+   */
+  uint64_t enroll(const string &name, const Mat &frame, bool persist = false);
+
+  /**
+   * Enrolls an already extracted feature for the given person.
+   *
+   * @param name The name of the person.
+   * @param feature The feature vector, as produced by the recognition model
+   * (1x128, CV_32F).
+   * @return The id of the new template, 0 if the feature was rejected.
+   */
+  uint64_t enrollFeature(const string &name, const Mat &feature);
+
+  /**
+   * Removes a person and all of their templates from the gallery.
+   *
+   * @param name The name of the person.
+   * @param persist If true, the person's sub-folder of the database is deleted
+   * as well. Otherwise the images of the person come back with the next
+   * reload of the database.
+   * @return true if the person was known.
+   */
+  bool remove(const string &name, bool persist = false);
+
+  /**
+   * Removes one template of a person from the gallery. The person is removed
+   * when the last template is gone.
+   *
+   * @param name The name of the person.
+   * @param id The id of the template, as returned by enroll or getTemplateIds.
+   * @param persist If true, the image the template was extracted from is
+   * deleted as well, unless other templates still stem from it.
+   * @return true if the template existed.
+   */
+  bool removeTemplate(const string &name, uint64_t id, bool persist = false);
+
+  /**
+   * Returns the number of templates enrolled for the given person.
+   */
+  size_t getTemplateCount(const string &name) const;
+
+  /**
+   * Returns the ids of the templates enrolled for the given person.
+   */
+  vector<uint64_t> getTemplateIds(const string &name) const;
+
+  /**
+   * Writes all enrolled features to a cache file (yml, xml or json), so
+   * features enrolled with enrollFeature survive a restart.
+   *
+   * @param path The cache file to write.
+   * @return true if the file was written.
+   */
+  bool saveFeatures(const filesystem::path &path) const;
+
+  /**
+   * Replaces the gallery with the features of a cache file written by
+   * saveFeatures. The gallery is left as is if the file holds features of
+   * another model.
+   *
+   * @param path The cache file to read.
+   * @return true if the file was read.
+   */
+  bool loadFeatures(const filesystem::path &path);
+
+  /**
+   * Returns the accumulated inference times of the face detection and
+   * feature extraction.
+   */
+  StageTimings getStageTimings() const;
+
+  /**
+   * Resets the accumulated inference times.
+   */
+  void resetStageTimings();
+
   // Getter and setter for database path
-  filesystem::path getDbPath() const { return dbPath; }
+  filesystem::path getDbPath() const {
+    lock_guard<mutex> lock(watchMutex);
+    return dbPath;
+  }
   void setDbPath(const filesystem::path &path) {
     this->isDBLoaded = NOT_LOADED;
+    lock_guard<mutex> lock(watchMutex);
     dbPath = path;
   }
 
@@ -162,8 +422,14 @@ private:
   int maxSize = 400;
   /// @brief Indicates whether the database is loaded.
   atomic<dbLoadStatus> isDBLoaded = NOT_LOADED;
-  /// @brief a mapping of name to a vector of features.
-  unordered_map<string, vector<Mat>> featuresMap;
+  /// @brief a mapping of name to a vector of templates.
+  unordered_map<string, vector<FaceTemplate>> featuresMap;
+  /// @brief Guards featuresMap, shared for matching, exclusive for updates.
+  mutable shared_mutex featuresMutex;
+  /// @brief Serializes inference, the models are not thread-safe.
+  mutable mutex modelMutex;
+  /// @brief Inference times, guarded by modelMutex
+  StageTimings stageTimings;
   /// @brief Face detection model
   Ptr<FaceDetectorYN> detector;
   /// @brief Face recognition model
@@ -174,6 +440,19 @@ private:
   filesystem::path dbPath;
   /// @brief Last modification time of the database folder
   filesystem::file_time_type lastModTime;
+  /// @brief Files written by enroll, with their modification time, which the
+  /// watcher ignores
+  map<filesystem::path, filesystem::file_time_type> ownWrites;
+  /// @brief Files and folders deleted by remove and removeTemplate while a
+  /// reload scans the folder, so it does not bring them back. Guarded by
+  /// featuresMutex, as is scansRunning.
+  vector<filesystem::path> deletedPaths;
+  /// @brief Number of reloads scanning the folder
+  int scansRunning = 0;
+  /// @brief Id of the next template
+  atomic<uint64_t> nextTemplateId{1};
+  /// @brief Guards dbPath, lastModTime and ownWrites
+  mutable mutex watchMutex;
   /// @brief Watcher thread
   thread watcherThread;
   /// @brief Flag to control watcher thread
@@ -188,7 +467,32 @@ private:
   void watcherThreadFunc();
 
   /**
-   * Gets the latest modification time of all files in the database folder.
+   * Detects and recognizes the faces of the frame, or of a region of it.
+   *
+   * @param frame The input frame.
+   * @param region The region to search for faces, empty for the full frame.
+   * @param threshold The similarity threshold for matching.
+   * @param visualize If true, visualizes the detected faces.
+   * @return list of Matching faces with their names and scores.
+   */
+  vector<MatchResult> detectAndMatch(Mat &frame, const Rect &region, float threshold,
+                                     bool visualize);
+
+  /**
+   * Extracts the templates of all images in the persons database folder.
+   *
+   * @param persondb_folder The folder containing the persons database.
+   * @param features_map Filled with the templates per person, without ids.
+   * @param scanned Filled with the paths of all scanned images.
+   * @param visualize If true, writes images with suffix _visualize.
+   */
+  void scanPersonsFolder(const filesystem::path &persondb_folder,
+                         unordered_map<string, vector<FaceTemplate>> &features_map,
+                         set<filesystem::path> &scanned, bool visualize);
+
+  /**
+   * Gets the latest modification time of all files in the database folder,
+   * ignoring the files written by this instance.
    */
   filesystem::file_time_type getLatestModTime(const filesystem::path &path);
 
@@ -218,14 +522,4 @@ private:
    * @return A vector of feature matrices for each detected face.
    */
   vector<DetectedFace> extractFeatures(Mat &frame);
-
-  /**
-   * Finds the best matching person for the given face feature.
-   *
-   * @param faceFeature The feature vector of the face to match.
-   * @param threshold The similarity threshold for matching.
-   * @return A MatchResults object, containing a vector of MatchResult
-   * structures and the name of the best matching person.
-   */
-  MatchResults findBestMatch(const Mat &faceFeature, float threshold = 0.3f);
 };
@@ -1,6 +1,9 @@
 #include "facerecognition.hpp"
 #include "helper.hpp"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <iostream>
 #include <opencv2/dnn.hpp>
@@ -9,6 +12,7 @@
 #include <opencv2/objdetect.hpp>
 #include <opencv2/objdetect/face.hpp>
 #include <opencv2/opencv.hpp>
+#include <set>
 
 using namespace cv;
 using namespace std;
@@ -17,6 +21,38 @@ using namespace std;
 #define nmsThreshold 0.3
 #define topK 5000
 
+/// @brief A person name must map to exactly one sub-folder of the database.
+static bool isValidPersonName(const string &name) {
+  return !name.empty() && name != "." && name != ".." && name.find('/') == string::npos;
+}
+
+/// @brief A feature must have the shape FaceRecognizerSF::feature returns, else match throws.
+static bool isValidFeature(const Mat &feature) {
+  return feature.rows == 1 && feature.cols == 128 && feature.type() == CV_32FC1;
+}
+
+/// @brief Returns the result with the highest score, or Unknown if there is none.
+static MatchResult bestOf(const vector<MatchResult> &results) {
+  if (results.empty()) {
+    return MatchResult{"Unknown", 0.0};
+  }
+  MatchResult best_match = results[0];
+  for (const MatchResult &result : results) {
+    if (result.score > best_match.score) {
+      best_match = result;
+    }
+  }
+  return best_match;
+}
+
+/// @brief Scales and shifts the box and landmarks of a face detection row.
+static void mapFaceDetect(Mat &facedetect, float scale, float offsetX, float offsetY) {
+  for (int c = 0; c < 14; c++) {
+    float offset = (c == 2 || c == 3) ? 0.0f : (c % 2 == 0 ? offsetX : offsetY);
+    facedetect.at<float>(0, c) = facedetect.at<float>(0, c) * scale + offset;
+  }
+}
+
 FaceRecognition::FaceRecognition(const std::string &fdModelPath, const std::string &frModelPath,
                                  int maxSize) {
   FR_DEBUG("Initializing face recognition");
@@ -32,8 +68,16 @@ FaceRecognition::FaceRecognition(const std::string &fdModelPath, const std::stri
 
 FaceRecognition::~FaceRecognition() { stopWatching(); }
 
+void FaceRecognition::setDetectionParams(float score_threshold, float nms_threshold, int top_k) {
+  lock_guard<mutex> lock(modelMutex);
+  detector->setScoreThreshold(score_threshold);
+  detector->setNMSThreshold(nms_threshold);
+  detector->setTopK(top_k);
+}
+
 void FaceRecognition::startWatching(int check_interval_seconds) {
-  if (dbPath.empty()) {
+  filesystem::path folder = getDbPath();
+  if (folder.empty()) {
     FR_ERROR("Cannot start watching: no database path set");
     return;
   }
@@ -44,10 +88,14 @@ void FaceRecognition::startWatching(int check_interval_seconds) {
   }
 
   checkInterval = check_interval_seconds;
-  lastModTime = getLatestModTime(dbPath);
+  auto currentModTime = getLatestModTime(folder);
+  {
+    lock_guard<mutex> lock(watchMutex);
+    lastModTime = currentModTime;
+  }
   watcherRunning.store(true);
   watcherThread = std::thread(&FaceRecognition::watcherThreadFunc, this);
-  FR_DEBUG("Started watching database folder: %s", dbPath.c_str());
+  FR_DEBUG("Started watching database folder: %s", folder.c_str());
 }
 
 void FaceRecognition::stopWatching() {
@@ -63,11 +111,19 @@ void FaceRecognition::stopWatching() {
 void FaceRecognition::watcherThreadFunc() {
   while (watcherRunning.load()) {
     try {
-      auto currentModTime = getLatestModTime(dbPath);
-      if (currentModTime > lastModTime) {
+      filesystem::path folder = getDbPath();
+      auto currentModTime = getLatestModTime(folder);
+      bool changed = false;
+      {
+        lock_guard<mutex> lock(watchMutex);
+        if (currentModTime > lastModTime) {
+          lastModTime = currentModTime;
+          changed = true;
+        }
+      }
+      if (changed) {
         FR_DEBUG("Database folder changed, reloading...");
-        lastModTime = currentModTime;
-        loadPersonsDB(dbPath, true, false);
+        loadPersonsDB(folder, true, false);
       }
     } catch (const std::exception &e) {
       FR_DEBUG("Error checking database folder: %s", e.what());
@@ -80,10 +136,15 @@ void FaceRecognition::watcherThreadFunc() {
 filesystem::file_time_type FaceRecognition::getLatestModTime(const filesystem::path &path) {
   filesystem::file_time_type latestTime = filesystem::file_time_type::min();
 
+  // Held during the scan, so enroll cannot write a file the scan sees unrecorded
+  lock_guard<mutex> lock(watchMutex);
   try {
     for (const auto &entry : filesystem::recursive_directory_iterator(path)) {
       if (entry.is_regular_file()) {
         auto fileTime = entry.last_write_time();
+        auto own = ownWrites.find(entry.path());
+        if (own != ownWrites.end() && own->second == fileTime)
+          continue;
         if (fileTime > latestTime) {
           latestTime = fileTime;
         }
@@ -152,18 +213,17 @@ vector<DetectedFace> FaceRecognition::extractFeatures(Mat &frame) {
     FR_ERROR("Frame is empty or invalid");
     return {};
   }
+  auto start = chrono::steady_clock::now();
   Size originalSize = frame.size();
   resizeFrame(frame, true);
-  FR_DEBUG("Frame size: %d x %d", frame.cols, frame.rows);
   // FR_DEBUG("Detector input size: %d x %d", detector->getInputSize().width,
   //          detector->getInputSize().height);
+  lock_guard<mutex> lock(modelMutex);
+  auto detectStart = chrono::steady_clock::now();
   detector->setInputSize(frame.size());
   Mat faces;
   detector->detect(frame, faces);
-  // FR_DEBUG("Found %d faces", faces.rows);
-  if (faces.rows <= 0) {
-    FR_WARNING("Cannot find any faces");
-  }
+  auto detected = chrono::steady_clock::now();
   vector<DetectedFace> detfaces;
   for (int i = 0; i < faces.rows; i++) {
     Mat aligned_img;
@@ -173,20 +233,50 @@ vector<DetectedFace> FaceRecognition::extractFeatures(Mat &frame) {
     detfaces.push_back(
         DetectedFace{"Unknown", faces.row(i).clone(), feature.clone(), originalSize});
   }
+  auto end = chrono::steady_clock::now();
+  stageTimings.totalMs += chrono::duration<double, milli>(end - start).count();
+  stageTimings.detectMs += chrono::duration<double, milli>(detected - detectStart).count();
+  stageTimings.featureMs += chrono::duration<double, milli>(end - detected).count();
+  stageTimings.frames++;
+  stageTimings.faces += detfaces.size();
+  // Log outside of the timed part
+  FR_DEBUG("Frame size: %d x %d", frame.cols, frame.rows);
+  if (faces.rows <= 0) {
+    FR_WARNING("Cannot find any faces");
+  }
   return detfaces;
 }
 
+vector<DetectedFace> FaceRecognition::detectFaces(const Mat &frame) {
+  if (frame.empty()) {
+    FR_WARNING("Frame is empty or invalid");
+    return {};
+  }
+  Mat frame_copy = frame.clone();
+  return extractFeatures(frame_copy);
+}
+
+StageTimings FaceRecognition::getStageTimings() const {
+  lock_guard<mutex> lock(modelMutex);
+  return stageTimings;
+}
+
+void FaceRecognition::resetStageTimings() {
+  lock_guard<mutex> lock(modelMutex);
+  stageTimings = StageTimings();
+}
+
 MatchResults FaceRecognition::findBestMatch(const Mat &faceFeature, float threshold) {
   MatchResult bestmatch = {"Unknown", 0.0};
   vector<MatchResult> results;
 
+  shared_lock<shared_mutex> lock(featuresMutex);
   for (const auto &pair : featuresMap) {
     const string &personName = pair.first;
-    const vector<Mat> features = pair.second;
-    for (Mat feat : features) {
-      double score = face_recognizer->match(faceFeature, feat, FaceRecognizerSF::FR_COSINE);
+    for (const FaceTemplate &tmpl : pair.second) {
+      double score =
+          face_recognizer->match(faceFeature, tmpl.feature, FaceRecognizerSF::FR_COSINE);
       results.push_back({personName, float(score)});
-      FR_DEBUG("Person %s, score: %f", personName.c_str(), score);
       if ((score > bestmatch.score) && (score > threshold)) {
         bestmatch = MatchResult{personName, float(score)};
       }
@@ -197,14 +287,17 @@ MatchResults FaceRecognition::findBestMatch(const Mat &faceFeature, float thresh
 }
 
 void FaceRecognition::loadPersonsDB(filesystem::path persondb_folder, bool force, bool visualize) {
-  if (dbPath.empty()) {
-    FR_DEBUG("Loading personsDB from %s", persondb_folder.c_str());
-    this->isDBLoaded = NOT_LOADED;
-  } else if (dbPath != persondb_folder) {
-    FR_DEBUG("Database path changed, reloading...");
-    this->isDBLoaded = NOT_LOADED;
+  {
+    lock_guard<mutex> lock(watchMutex);
+    if (dbPath.empty()) {
+      FR_DEBUG("Loading personsDB from %s", persondb_folder.c_str());
+      this->isDBLoaded = NOT_LOADED;
+    } else if (dbPath != persondb_folder) {
+      FR_DEBUG("Database path changed, reloading...");
+      this->isDBLoaded = NOT_LOADED;
+    }
+    this->dbPath = persondb_folder;
   }
-  this->dbPath = persondb_folder;
 
   if (this->isDBLoaded == LOADED && !force) {
     FR_DEBUG("load status, %s", getLoadStatusString(this->isDBLoaded).c_str());
@@ -214,12 +307,98 @@ void FaceRecognition::loadPersonsDB(filesystem::path persondb_folder, bool force
   }
   this->isDBLoaded = LOADING;
   FR_DEBUG("Loading personsDB from %s", persondb_folder.c_str());
-  this->featuresMap.clear();
+  {
+    // Deletions only need to be remembered while a scan runs
+    unique_lock<shared_mutex> lock(featuresMutex);
+    if (scansRunning++ == 0)
+      deletedPaths.clear();
+  }
+  // Build the new gallery aside, so matching keeps working while loading
+  unordered_map<string, vector<FaceTemplate>> newFeaturesMap;
+  set<filesystem::path> scanned;
+  try {
+    scanPersonsFolder(persondb_folder, newFeaturesMap, scanned, visualize);
+  } catch (...) {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    scansRunning--;
+    throw;
+  }
+  {
+    // Files of this instance are part of the scan now, stop ignoring them
+    lock_guard<mutex> lock(watchMutex);
+    for (const filesystem::path &path : scanned) {
+      auto own = ownWrites.find(path);
+      if (own != ownWrites.end()) {
+        lastModTime = max(lastModTime, own->second);
+        ownWrites.erase(own);
+      }
+    }
+  }
+  {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    // Scanned files keep the ids of their templates, so handles stay valid
+    map<filesystem::path, vector<uint64_t>> oldIds;
+    for (const auto &pair : featuresMap) {
+      for (const FaceTemplate &tmpl : pair.second) {
+        if (!tmpl.source.empty())
+          oldIds[tmpl.source].push_back(tmpl.id);
+      }
+    }
+    for (auto &pair : newFeaturesMap) {
+      for (FaceTemplate &tmpl : pair.second) {
+        vector<uint64_t> &ids = oldIds[tmpl.source];
+        if (ids.empty()) {
+          tmpl.id = nextTemplateId++;
+        } else {
+          tmpl.id = ids.front();
+          ids.erase(ids.begin());
+        }
+      }
+    }
+    // Keep what was enrolled in memory, or written to the folder after the scan
+    for (const auto &pair : featuresMap) {
+      for (const FaceTemplate &tmpl : pair.second) {
+        bool inFolder = tmpl.source.parent_path().parent_path() == persondb_folder;
+        if (tmpl.source.empty() ||
+            (inFolder && !scanned.count(tmpl.source) && filesystem::exists(tmpl.source)))
+          newFeaturesMap[pair.first].push_back(tmpl);
+      }
+    }
+    // Drop what remove or removeTemplate deleted while the folder was scanned
+    for (auto &pair : newFeaturesMap) {
+      vector<FaceTemplate> &templates = pair.second;
+      templates.erase(remove_if(templates.begin(), templates.end(),
+                                [this](const FaceTemplate &tmpl) {
+                                  for (const filesystem::path &deleted : deletedPaths) {
+                                    if ((tmpl.source == deleted ||
+                                         tmpl.source.parent_path() == deleted) &&
+                                        !filesystem::exists(tmpl.source))
+                                      return true;
+                                  }
+                                  return false;
+                                }),
+                      templates.end());
+    }
+    for (const filesystem::path &deleted : deletedPaths) {
+      auto it = newFeaturesMap.find(deleted.filename().string());
+      if (it != newFeaturesMap.end() && it->second.empty())
+        newFeaturesMap.erase(it);
+    }
+    if (--scansRunning == 0)
+      deletedPaths.clear();
+    featuresMap.swap(newFeaturesMap);
+  }
+  this->isDBLoaded = LOADED;
+}
+
+void FaceRecognition::scanPersonsFolder(const filesystem::path &persondb_folder,
+                                        unordered_map<string, vector<FaceTemplate>> &features_map,
+                                        set<filesystem::path> &scanned, bool visualize) {
   // Iterate over all folders
   for (auto &p : filesystem::directory_iterator(persondb_folder)) {
     if (p.is_directory()) {
       string personName = p.path().filename().string();
-      vector<Mat> features;
+      vector<FaceTemplate> features;
       FR_DEBUG("Loading person: %s", personName.c_str());
       for (auto &imgPath : filesystem::directory_iterator(p.path())) {
         if (!imgPath.is_directory()) {
@@ -228,13 +407,14 @@ void FaceRecognition::loadPersonsDB(filesystem::path persondb_folder, bool force
           if (imgPath.path().filename().string().find("_visualize") != string::npos) {
             continue;
           }
+          scanned.insert(imgPath.path());
           Mat img = imread(imgPath.path().string());
           if (img.empty()) {
             FR_ERROR("Cannot read image: %s", imgPath.path().c_str());
             continue;
           }
           for (const DetectedFace &detectedFace : extractFeatures(img)) {
-            features.push_back(detectedFace.feature);
+            features.push_back(FaceTemplate{detectedFace.feature, imgPath.path()});
           }
           if (visualize) {
             filesystem::path original_path = imgPath.path();
@@ -248,12 +428,233 @@ void FaceRecognition::loadPersonsDB(filesystem::path persondb_folder, bool force
           FR_ERROR("Unexpected sub-directory: %s", imgPath.path().c_str());
         }
       }
-      featuresMap[personName] = features;
+      features_map[personName] = features;
     } else {
       FR_ERROR("Unexpected file: %s", p.path().c_str());
     }
   }
+}
+
+uint64_t FaceRecognition::enroll(const string &name, const Mat &frame, bool persist) {
+  if (name.empty() || frame.empty()) {
+    FR_WARNING("Cannot enroll: name or frame is empty");
+    return 0;
+  }
+  Mat frame_copy = frame.clone();
+  vector<DetectedFace> det_faces = extractFeatures(frame_copy);
+  if (det_faces.empty()) {
+    FR_WARNING("Cannot enroll %s: no face found", name.c_str());
+    return 0;
+  }
+  // Bystanders may be visible as well, the largest face is the one to enroll
+  auto largest = max_element(det_faces.begin(), det_faces.end(),
+                             [](const DetectedFace &a, const DetectedFace &b) {
+                               return a.bbox().area() < b.bbox().area();
+                             });
+  FaceTemplate tmpl{largest->feature, filesystem::path(), nextTemplateId++};
+
+  filesystem::path folder = getDbPath();
+  if (persist) {
+    if (folder.empty() || !isValidPersonName(name)) {
+      FR_WARNING("Cannot persist enrollment of %s: no database path or invalid name",
+                 name.c_str());
+    } else {
+      auto stamp = chrono::duration_cast<chrono::milliseconds>(
+                       chrono::system_clock::now().time_since_epoch())
+                       .count();
+      filesystem::path imgPath = folder / name / ("enroll_" + to_string(stamp) + ".jpg");
+      // Write a crop around the enrolled face only, a reload would enroll bystanders as well
+      float scale = frame.cols / (float)frame_copy.cols;
+      Rect2i box = largest->bbox();
+      int pad = int(0.3f * max(box.width, box.height));
+      Rect crop(int((box.x - pad) * scale), int((box.y - pad) * scale),
+                int((box.width + 2 * pad) * scale), int((box.height + 2 * pad) * scale));
+      crop &= Rect(0, 0, frame.cols, frame.rows);
+      // The watcher ignores this file, it is enrolled below already
+      lock_guard<mutex> lock(watchMutex);
+      error_code ec;
+      filesystem::create_directories(imgPath.parent_path(), ec);
+      if (!ec && !crop.empty() && imwrite(imgPath.string(), frame(crop))) {
+        tmpl.source = imgPath;
+        ownWrites[imgPath] = filesystem::last_write_time(imgPath, ec);
+      } else {
+        FR_WARNING("Cannot write enrollment image: %s", imgPath.c_str());
+      }
+    }
+  }
+
+  size_t count;
+  {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    vector<FaceTemplate> &templates = featuresMap[name];
+    // A reload may have picked up the written file already
+    auto loaded = find_if(templates.begin(), templates.end(), [&tmpl](const FaceTemplate &t) {
+      return !tmpl.source.empty() && t.source == tmpl.source;
+    });
+    if (loaded == templates.end())
+      templates.push_back(tmpl);
+    else
+      tmpl.id = loaded->id;
+    count = templates.size();
+    // The file is new, a running reload must not drop it as deleted
+    deletedPaths.erase(remove_if(deletedPaths.begin(), deletedPaths.end(),
+                                 [&tmpl](const filesystem::path &deleted) {
+                                   return !tmpl.source.empty() &&
+                                          (deleted == tmpl.source ||
+                                           deleted == tmpl.source.parent_path());
+                                 }),
+                       deletedPaths.end());
+  }
+  FR_INFO("Enrolled %s, %zu templates", name.c_str(), count);
+  return tmpl.id;
+}
+
+uint64_t FaceRecognition::enrollFeature(const string &name, const Mat &feature) {
+  if (name.empty() || !isValidFeature(feature)) {
+    FR_WARNING("Cannot enroll: name is empty or feature is not 1x128 CV_32F");
+    return 0;
+  }
+  uint64_t id = nextTemplateId++;
+  unique_lock<shared_mutex> lock(featuresMutex);
+  featuresMap[name].push_back(FaceTemplate{feature.clone(), filesystem::path(), id});
+  return id;
+}
+
+bool FaceRecognition::remove(const string &name, bool persist) {
+  filesystem::path folder = getDbPath();
+  persist = persist && !folder.empty() && isValidPersonName(name);
+  size_t erased;
+  {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    erased = featuresMap.erase(name);
+    if (persist && scansRunning > 0)
+      deletedPaths.push_back(folder / name);
+  }
+  if (persist) {
+    error_code ec;
+    filesystem::remove_all(folder / name, ec);
+    if (ec) {
+      FR_WARNING("Cannot remove folder of %s: %s", name.c_str(), ec.message().c_str());
+    }
+    lock_guard<mutex> lock(watchMutex);
+    for (auto it = ownWrites.begin(); it != ownWrites.end();) {
+      if (it->first.parent_path() == folder / name)
+        it = ownWrites.erase(it);
+      else
+        ++it;
+    }
+  }
+  return erased > 0;
+}
+
+bool FaceRecognition::removeTemplate(const string &name, uint64_t id, bool persist) {
+  filesystem::path source;
+  {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    auto it = featuresMap.find(name);
+    if (it == featuresMap.end())
+      return false;
+    vector<FaceTemplate> &templates = it->second;
+    auto tmpl = find_if(templates.begin(), templates.end(),
+                        [id](const FaceTemplate &t) { return t.id == id; });
+    if (tmpl == templates.end())
+      return false;
+    if (persist)
+      source = tmpl->source;
+    templates.erase(tmpl);
+    // One image can hold several faces, keep it while other templates use it
+    for (const FaceTemplate &tmpl : templates) {
+      if (tmpl.source == source)
+        source.clear();
+    }
+    if (templates.empty())
+      featuresMap.erase(it);
+    if (!source.empty() && scansRunning > 0)
+      deletedPaths.push_back(source);
+  }
+  if (!source.empty()) {
+    error_code ec;
+    if (!filesystem::remove(source, ec)) {
+      FR_WARNING("Cannot remove image %s", source.c_str());
+    }
+    lock_guard<mutex> lock(watchMutex);
+    ownWrites.erase(source);
+  }
+  return true;
+}
+
+size_t FaceRecognition::getTemplateCount(const string &name) const {
+  shared_lock<shared_mutex> lock(featuresMutex);
+  auto it = featuresMap.find(name);
+  return it == featuresMap.end() ? 0 : it->second.size();
+}
+
+vector<uint64_t> FaceRecognition::getTemplateIds(const string &name) const {
+  shared_lock<shared_mutex> lock(featuresMutex);
+  vector<uint64_t> ids;
+  auto it = featuresMap.find(name);
+  if (it != featuresMap.end()) {
+    for (const FaceTemplate &tmpl : it->second)
+      ids.push_back(tmpl.id);
+  }
+  return ids;
+}
+
+bool FaceRecognition::saveFeatures(const filesystem::path &path) const {
+  FileStorage fs(path.string(), FileStorage::WRITE);
+  if (!fs.isOpened()) {
+    FR_WARNING("Cannot open feature cache for writing: %s", path.c_str());
+    return false;
+  }
+  shared_lock<shared_mutex> lock(featuresMutex);
+  fs << "persons" << "[";
+  for (const auto &pair : featuresMap) {
+    fs << "{" << "name" << pair.first << "templates" << "[";
+    for (const FaceTemplate &tmpl : pair.second) {
+      fs << "{" << "feature" << tmpl.feature << "source" << tmpl.source.string() << "}";
+    }
+    fs << "]" << "}";
+  }
+  fs << "]";
+  return true;
+}
+
+bool FaceRecognition::loadFeatures(const filesystem::path &path) {
+  FileStorage fs(path.string(), FileStorage::READ);
+  if (!fs.isOpened()) {
+    FR_WARNING("Cannot open feature cache for reading: %s", path.c_str());
+    return false;
+  }
+  FileNode persons = fs["persons"];
+  if (!persons.isSeq()) {
+    FR_WARNING("Not a feature cache: %s", path.c_str());
+    return false;
+  }
+  unordered_map<string, vector<FaceTemplate>> newFeaturesMap;
+  for (const FileNode &person : persons) {
+    string name;
+    person["name"] >> name;
+    vector<FaceTemplate> &templates = newFeaturesMap[name];
+    for (const FileNode &node : person["templates"]) {
+      FaceTemplate tmpl;
+      string source;
+      node["feature"] >> tmpl.feature;
+      node["source"] >> source;
+      if (name.empty() || !isValidFeature(tmpl.feature)) {
+        FR_WARNING("Feature cache %s does not match the recognition model", path.c_str());
+        return false;
+      }
+      tmpl.source = source;
+      tmpl.id = nextTemplateId++;
+      templates.push_back(tmpl);
+    }
+  }
+  {
+    unique_lock<shared_mutex> lock(featuresMutex);
+    featuresMap.swap(newFeaturesMap);
+  }
   this->isDBLoaded = LOADED;
+  return true;
 }
 
 void FaceRecognition::annotate_with_name(Mat &frame, const DetectedFace &face) {
@@ -280,9 +681,111 @@ void FaceRecognition::annotate_with_name(Mat &frame, const DetectedFace &face) {
           Scalar(255, 255, 255), thickness);
 }
 
+bool MotionGate::check(const Mat &frame, Rect &region) {
+  region = Rect();
+  stats.frames++;
+  skipped = false;
+  if (frame.empty() || config.sampleWidth <= 0) {
+    stats.processed++;
+    return true;
+  }
+
+  // A tiny grayscale sample is cheap to compare, compared to a detection pass
+  double scale = min(1.0, config.sampleWidth / (double)frame.cols);
+  Mat sample, gray;
+  resize(frame, sample, Size(), scale, scale, INTER_AREA);
+  if (sample.channels() == 3)
+    cvtColor(sample, gray, COLOR_BGR2GRAY);
+  else
+    gray = sample;
+  gray.convertTo(gray, CV_32F);
+
+  if (background.empty() || background.size() != gray.size()) {
+    background = gray;
+    framesSinceKeyframe = 0;
+    stats.processed++;
+    stats.keyframes++;
+    return true;
+  }
+
+  Mat diff, mask;
+  absdiff(gray, background, diff);
+  cv::threshold(diff, mask, config.pixelThreshold, 255, THRESH_BINARY);
+  mask.convertTo(mask, CV_8U);
+  accumulateWeighted(gray, background, config.learningRate);
+  int changed = countNonZero(mask);
+  bool motion = changed > 0 && changed >= config.minChangedFraction * mask.total();
+  framesSinceKeyframe++;
+
+  // A person standing still fades into the background, or stands outside of a
+  // region that keeps changing, so look at the full frame now and then
+  if (config.keyframeInterval > 0 && framesSinceKeyframe >= config.keyframeInterval) {
+    framesSinceKeyframe = 0;
+    stats.processed++;
+    stats.keyframes++;
+    return true;
+  }
+  if (!motion) {
+    skipped = true;
+    stats.skipped++;
+    return false;
+  }
+
+  stats.processed++;
+  if (config.changedRegionOnly) {
+    // Moving pixels rarely cover the whole face, so pad the changed region
+    Rect changedRect = boundingRect(mask);
+    int padX = changedRect.width / 2 + 1;
+    int padY = changedRect.height / 2 + 1;
+    Rect sampleRegion(changedRect.x - padX, changedRect.y - padY, changedRect.width + 2 * padX,
+                      changedRect.height + 2 * padY);
+    sampleRegion &= Rect(0, 0, mask.cols, mask.rows);
+    // Cropping only pays off if a good part of the frame can be left out
+    if (sampleRegion.area() * 2 < mask.cols * mask.rows) {
+      double sx = frame.cols / (double)mask.cols;
+      double sy = frame.rows / (double)mask.rows;
+      region = Rect(int(sampleRegion.x * sx), int(sampleRegion.y * sy),
+                    int(ceil(sampleRegion.width * sx)), int(ceil(sampleRegion.height * sy)));
+      region &= Rect(0, 0, frame.cols, frame.rows);
+      return true;
+    }
+  }
+  framesSinceKeyframe = 0;
+  return true;
+}
+
 vector<MatchResult> FaceRecognition::run(Mat &frame, float threshold, bool visualize) {
+  return detectAndMatch(frame, Rect(), threshold, visualize);
+}
+
+vector<MatchResult> FaceRecognition::run(Mat &frame, MotionGate &gate, float threshold,
+                                         bool visualize) {
+  Rect region;
+  if (!gate.check(frame, region)) {
+    FR_DEBUG("No motion, skipping frame");
+    return gate.lastResults;
+  }
+  gate.lastResults = detectAndMatch(frame, region, threshold, visualize);
+  return gate.lastResults;
+}
+
+vector<MatchResult> FaceRecognition::detectAndMatch(Mat &frame, const Rect &region,
+                                                    float threshold, bool visualize) {
   vector<DetectedFace> det_faces;
-  if (!visualize) {
+  if (!region.empty()) {
+    // Search the changed region only, then map the faces back into the frame
+    Mat crop = frame(region).clone();
+    det_faces = extractFeatures(crop);
+    Size originalSize = frame.size();
+    if (visualize)
+      resizeFrame(frame, true);
+    float frameScale = frame.cols / (float)originalSize.width;
+    for (DetectedFace &face : det_faces) {
+      mapFaceDetect(face.facedetect, region.width / (float)crop.cols * frameScale,
+                    region.x * frameScale, region.y * frameScale);
+      face.originalSize = originalSize;
+    }
+  } else if (!visualize) {
     Mat frame_copy = frame.clone();
     det_faces = extractFeatures(frame_copy);
   } else {
@@ -305,15 +808,10 @@ vector<MatchResult> FaceRecognition::run(Mat &frame, float threshold, bool visua
 }
 
 MatchResult FaceRecognition::run_one_face(Mat frame, float threshold, bool visualize) {
-  vector<MatchResult> results = run(frame, threshold, visualize);
-  if (results.empty()) {
-    return MatchResult{"Unknown", 0.0};
-  }
-  MatchResult best_match = results[0];
-  for (const MatchResult &result : results) {
-    if (result.score > best_match.score) {
-      best_match = result;
-    }
-  }
-  return best_match;
+  return bestOf(run(frame, threshold, visualize));
+}
+
+MatchResult FaceRecognition::run_one_face(Mat frame, MotionGate &gate, float threshold,
+                                          bool visualize) {
+  return bestOf(run(frame, gate, threshold, visualize));
 }